@@ -3,10 +3,11 @@
 #include "murmur.h"
 #include "mem.h"
 
-const datatype_t DATATYPE_NSTRING = { (cmp_fun_t)ns_cmp, (hash_fun_t)ns_hash, (clone_fun_t)ns_dup };
+const datatype_t DATATYPE_NSTRING = { (cmp_fun_t)ns_cmp, (hash_fun_t)ns_hash, (clone_fun_t)ns_dup,
+                                       (size_fun_t)ns_size };
 
 nstring_t *ns_alloc (uint32_t len) {
-    nstring_t *ns = nbd_malloc(sizeof(nstring_t) + len);
+    nstring_t *ns = nbd_malloc_tagged(sizeof(nstring_t) + len, "nstring");
     ns->len = len;
     return ns;
 }
@@ -20,6 +21,10 @@ uint32_t ns_hash (const nstring_t *ns) {
     return murmur32(ns->data, ns->len);
 }
 
+size_t ns_size (const nstring_t *ns) {
+    return sizeof(nstring_t) + ns->len;
+}
+
 nstring_t *ns_dup (const nstring_t *ns1) {
     nstring_t *ns2 = ns_alloc(ns1->len);
     memcpy(ns2->data, ns1->data, ns1->len);
@@ -0,0 +1,29 @@
+/* 
+ * Written by Josh Dybnis and released to the public domain, as explained at
+ * http://creativecommons.org/licenses/publicdomain
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "datatype.h"
+
+// An arena hands out memory that is never freed individually. nbd_free() of memory from an arena does nothing.
+// All of it is released at once by nbd_arena_free(), after an RCU grace period, so an arena can be released while
+// other threads might still be reading from it.
+typedef struct nbd_arena nbd_arena_t;
+
+#define ARENA_MAX_ALLOC (1 << 16)
+
+nbd_arena_t *nbd_arena_create (void);
+void *arena_alloc (nbd_arena_t *arena, size_t n) __attribute__((malloc, alloc_size(2)));
+void nbd_arena_free (nbd_arena_t *arena);
+
+// Copy <x> into <arena>, if <type> can say how big it is. Otherwise clone it the usual way.
+static inline void *arena_clone (nbd_arena_t *arena, const datatype_t *type, void *x) {
+    if (type->size == NULL)
+        return type->clone(x);
+    size_t n = type->size(x);
+    return memcpy(arena_alloc(arena, n), x, n);
+}
+
+#endif//ARENA_H
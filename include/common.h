@@ -19,16 +19,12 @@
 
 #ifndef NBD_SINGLE_THREADED
 
-#define MAX_NUM_THREADS  32 // make this whatever you want, but make it a power of 2
-
 #define SYNC_SWAP(addr,x)         __sync_lock_test_and_set(addr,x)
 #define SYNC_CAS(addr,old,x)      __sync_val_compare_and_swap(addr,old,x)
 #define SYNC_ADD(addr,n)          __sync_add_and_fetch(addr,n)
 #define SYNC_FETCH_AND_OR(addr,x) __sync_fetch_and_or(addr,x)
 #else// NBD_SINGLE_THREADED
 
-#define MAX_NUM_THREADS  1
-
 #define SYNC_SWAP(addr,x)         ({ typeof(*(addr)) _old = *(addr); *(addr)  = (x); _old; })
 #define SYNC_CAS(addr,old,x)      ({ typeof(*(addr)) _old = *(addr); *(addr)  = (x); _old; })
 //#define SYNC_CAS(addr,old,x)    ({ typeof(*(addr)) _old = *(addr); if ((old) == _old) { *(addr)  = (x); } _old; })
@@ -70,6 +66,8 @@ typedef unsigned char      uint8_t;
 
 typedef size_t markable_t;
 
+typedef void (*free_t) (void *);
+
 static inline uint64_t rdtsc (void) {
     unsigned l, u;
     __asm__ __volatile__("rdtsc" : "=a" (l), "=d" (u));
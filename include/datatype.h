@@ -4,11 +4,13 @@
 typedef int      (*cmp_fun_t)   (void *, void *);
 typedef void *   (*clone_fun_t) (void *);
 typedef uint32_t (*hash_fun_t)  (void *);
+typedef size_t   (*size_fun_t)  (void *);
 
 typedef struct datatype {
     cmp_fun_t   cmp;
     hash_fun_t  hash;
     clone_fun_t clone;
+    size_fun_t  size; // optional, lets maps with an arena copy keys into it
 } datatype_t;
 
 #endif//DATATYPE_H
@@ -6,13 +6,16 @@
  *
  * www.research.ibm.com/people/m/michael/ieeetpds-2004.pdf
  *
+ * Unlike RCU, the amount of memory waiting to be freed is bounded. A thread scans the hazard pointers of all the
+ * other threads once it has about twice as many objects waiting as there are hazard pointers, so every scan frees
+ * at least half of what it looks at.
  */
 #ifndef HAZARD_H
 #define HAZARD_H
 
-#define STATIC_HAZ_PER_THREAD 2
+// Enough for the skiplist, which keeps a predecessor and a successor protected at every level.
+#define STATIC_HAZ_PER_THREAD 64
 
-typedef void (*free_t) (void *);
 typedef void *haz_t;
 
 //static inline void haz_set (volatile haz_t *haz, void *x) { *haz = x; haz_t y = *haz; y = y; }
@@ -24,4 +27,15 @@ void   haz_register_dynamic   (haz_t *haz);
 void   haz_unregister_dynamic (haz_t *haz);
 void   haz_defer_free         (void *p, free_t f);
 
+// Reclamation counters. The counts for a single thread stay with its thread index.
+typedef struct haz_stats {
+    uint64_t deferred;    // objects passed to haz_defer_free()
+    uint64_t pending;     // objects waiting to be freed
+    uint64_t max_pending; // the most objects a single thread has had waiting to be freed
+    uint64_t scans;       // times a thread scanned the other threads' hazard pointers
+} haz_stats_t;
+
+// A <thread_index> of -1 means all threads.
+void haz_stats (haz_stats_t *stats, int thread_index);
+
 #endif
@@ -0,0 +1,49 @@
+/*
+ * Written by Josh Dybnis and released to the public domain, as explained at
+ * http://creativecommons.org/licenses/publicdomain
+ *
+ * sampled operation latency histograms
+ *
+ * Once sampling is started, about one in every <sample_every> calls to each of the operations below is timed with
+ * the timestamp counter. Each thread adds its samples to its own histograms, which are merged when they are read.
+ * When sampling is stopped the instrumented calls only pay for a test of a global.
+ */
+#ifndef LATENCY_H
+#define LATENCY_H
+
+typedef enum {
+    NBD_LATENCY_MAP_GET,
+    NBD_LATENCY_MAP_CAS, // including map_set(), map_add(), and map_replace()
+    NBD_LATENCY_MAP_REMOVE,
+    NBD_LATENCY_TXN_GET,
+    NBD_LATENCY_TXN_SET,
+    NBD_LATENCY_TXN_COMMIT,
+    NBD_LATENCY_NUM_OPS
+} nbd_latency_op_e;
+
+// A <sample_every> of 0 stops the sampling. The samples taken so far are kept.
+void nbd_latency_start (int sample_every);
+
+// Summed over all threads. The percentiles are in ns, and <percentile> is between 0 and 100. They are accurate to
+// within about 3%.
+uint64_t nbd_latency_count (nbd_latency_op_e op);
+uint64_t nbd_latency_percentile (nbd_latency_op_e op, double percentile);
+void nbd_latency_print (void);
+
+extern int latency_sample_every_;
+uint64_t latency_sample (void);
+void latency_record (nbd_latency_op_e op, uint64_t start);
+
+// Returns the time the operation started if it is sampled, or 0.
+static inline uint64_t latency_start (void) {
+    if (EXPECT_FALSE(latency_sample_every_ != 0))
+        return latency_sample();
+    return 0;
+}
+
+static inline void latency_end (nbd_latency_op_e op, uint64_t start) {
+    if (EXPECT_FALSE(start != 0)) {
+        latency_record(op, start);
+    }
+}
+#endif//LATENCY_H
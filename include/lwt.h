@@ -20,8 +20,16 @@
 #endif
 
 // Dump trace records to <file_name>. The file should be post-processed with "sort" before viewing.
+//
+// The threads keep tracing while a dump is taken, so the trace can be left on and dumped whenever something looks
+// wrong. The buffers are copied one at a time, and records that a thread writes over while its buffer is being
+// copied are left out.
 void lwt_dump (const char *file_name) __attribute__ ((externally_visible));
 
+// Dump trace records to <file_name> in a compact binary form, which takes a fraction of the time lwt_dump() does.
+// "output/lwt_decode <file_name>" turns it into text, with the records of all the threads merged in timestamp order.
+void lwt_dump_binary (const char *file_name) __attribute__ ((externally_visible));
+
 // <flags> indicates what kind of trace messages should be included in the dump. <flags> is a sequence of letters
 // followed by numbers (e.g. "x1c9n2g3"). The letters indicate trace categories and the numbers are trace levels 
 // for each category. If a category appears in <flags>, then messages from that category will be included in the
@@ -43,6 +51,8 @@ static inline void lwt_trace (const char *flag, const char *format, size_t value
     }
 }
 
+// Stop recording, so the records leading up to a failure are still there when the trace is dumped. Threads that
+// trace after this don't wait, their records are just dropped. ASSERT() calls it.
 void lwt_halt (void);
 
 #endif//LWT_H
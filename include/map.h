@@ -6,6 +6,7 @@
 typedef struct map map_t;
 typedef struct map_iter map_iter_t;
 typedef struct map_impl map_impl_t;
+struct nbd_arena;
 
 #ifdef NBD32
 typedef uint32_t map_key_t;
@@ -16,6 +17,10 @@ typedef uint64_t map_val_t;
 #endif
 
 map_t *   map_alloc   (const map_impl_t *map_impl, const datatype_t *key_type);
+map_t *   map_alloc_arena (const map_impl_t *map_impl, const datatype_t *key_type);
+// map_get() is its own critical section, and leaving it can pass through a quiescent state (see rcu_leave()). If
+// the value points to memory that can be freed with rcu_defer_free(), call map_get() between rcu_enter() and
+// rcu_leave() and use the value before leaving.
 map_val_t map_get     (map_t *map, map_key_t key);
 map_val_t map_set     (map_t *map, map_key_t key, map_val_t new_val);
 map_val_t map_add     (map_t *map, map_key_t key, map_val_t new_val);
@@ -26,6 +31,25 @@ map_val_t map_count   (map_t *map);
 void      map_print   (map_t *map, int verbose);
 void      map_free    (map_t *map);
 
+// Contention counters. Each thread counts into its own row for the map, so they are cheap enough to always be on.
+// A <thread_index> of -1 sums them over all threads.
+typedef struct map_stats {
+    uint64_t cas_failures;   // CASes that lost a race and had to be retried
+    uint64_t restarts;       // operations that started over, from the head of a list or in the next hashtable
+    uint64_t copy_help;      // entries copied to a bigger hashtable while helping it grow
+    uint64_t unlink_assists; // removed nodes (or outgrown hashtables) unlinked by a thread that came across them
+} map_stats_t;
+void      map_stats   (map_t *map, map_stats_t *stats, int thread_index);
+
+// The maps don't own their values. If a value points to memory, whoever takes it out of the map (map_remove(), or
+// map_set() and friends returning the old value) can free it with rcu_defer_call(). A thread that got it from
+// map_get() can only rely on it inside an rcu_enter() and rcu_leave() of its own around the map_get() call, or if
+// it has turned off implicit quiescent states with rcu_set_update_interval(0).
+
+// Iterators don't keep the thread in a critical section for the whole scan. Every MAP_ITER_BATCH items they leave
+// it and pass through a quiescent state, and then find their place again. Keys returned by map_iter_next() are
+// only good until the next call to map_iter_next() or map_iter_free() on the iterator.
+#define MAP_ITER_BATCH 64
 map_iter_t * map_iter_begin (map_t *map, map_key_t key);
 map_val_t    map_iter_next  (map_iter_t *iter, map_key_t *key);
 void         map_iter_free  (map_iter_t *iter);
@@ -37,6 +61,7 @@ void         map_iter_free  (map_iter_t *iter);
 #define CAS_EXPECT_WHATEVER       (-2)
 
 typedef void *       (*map_alloc_t)  (const datatype_t *);
+typedef void *       (*map_alloc_arena_t) (const datatype_t *, struct nbd_arena *);
 typedef map_val_t    (*map_cas_t)    (void *, map_key_t , map_val_t, map_val_t);
 typedef map_val_t    (*map_get_t)    (void *, map_key_t );
 typedef map_val_t    (*map_remove_t) (void *, map_key_t );
@@ -47,6 +72,18 @@ typedef void         (*map_free_t)   (void *);
 typedef map_iter_t * (*map_iter_begin_t) (void *, map_key_t);
 typedef map_val_t    (*map_iter_next_t)  (map_iter_t *, map_key_t *);
 typedef void         (*map_iter_free_t)  (map_iter_t *);
+typedef void         (*map_iter_yield_t) (map_iter_t *);
+
+// The counters behind map_stats(). A thread's row is allocated the first time it counts something.
+typedef struct map_counters map_counters_t;
+map_counters_t *map_counters_alloc (void);
+void            map_counters_free  (map_counters_t *counters);
+void            map_counters_sum   (map_counters_t *counters, map_stats_t *stats, int thread_index);
+map_stats_t *   map_counters_row   (map_counters_t *counters);
+map_counters_t *map_get_counters   (map_t *map); // NULL if the map's implementation doesn't keep counters
+#define MAP_COUNT(counters, field, n) (map_counters_row(counters)->field += (n))
+
+typedef map_counters_t * (*map_counters_get_t) (void *);
 
 struct map_impl {
     map_alloc_t  alloc;
@@ -60,6 +97,15 @@ struct map_impl {
     map_iter_begin_t iter_begin;
     map_iter_next_t  iter_next;
     map_iter_free_t  iter_free;
+
+    map_alloc_arena_t alloc_arena; // optional
+
+    // Called before the iterator's thread leaves its critical section. After that the iterator can't use any
+    // pointers into the map that are only protected by the critical section. The next call to iter_next resumes
+    // after the last item it returned. Optional, but without it iterators hold up reclamation until they're freed.
+    map_iter_yield_t iter_yield;
+
+    map_counters_get_t counters; // optional
 };
 
 #endif//MAP_H
@@ -6,4 +6,78 @@
 #define MEM_H
 void *nbd_malloc (size_t n) __attribute__((malloc, alloc_size(1)));
 void nbd_free (void *x) __attribute__((nonnull));
+size_t nbd_malloc_size (void *x); // usable size of a block from nbd_malloc(), or 0 if <x> didn't come from it
+
+// <n> must be the size the block was allocated with, or the size last passed to nbd_realloc() for it. Only for
+// blocks from nbd_malloc() and nbd_realloc() (not nbd_aligned_alloc(), chunks or pools).
+void nbd_free_sized (void *x, size_t n) __attribute__((nonnull));
+
+// Like realloc(), but the block must have come from nbd_malloc() and <n> can't be 0.
+void *nbd_realloc (void *x, size_t n) __attribute__((alloc_size(2)));
+
+// <alignment> must be a power of 2. The block is freed with nbd_free() like any other.
+void *nbd_aligned_alloc (size_t alignment, size_t n) __attribute__((malloc, alloc_size(2)));
+void nbd_mem_trim (void);
+void nbd_mem_set_retention (size_t bytes);
+
+// Huge pages cut down on TLB misses when a program touches a lot of memory, like a big hashtable. ADVISE asks
+// the kernel to back allocator regions with transparent huge pages. HUGETLB maps them from the hugetlbfs pool,
+// which has to be reserved ahead of time (/proc/sys/vm/nr_hugepages). Returns the mode that is actually in
+// effect, which is ADVISE if HUGETLB was asked for but there are no huge pages available.
+typedef enum { MEM_HUGE_PAGES_NONE, MEM_HUGE_PAGES_ADVISE, MEM_HUGE_PAGES_HUGETLB } mem_huge_pages_e;
+mem_huge_pages_e nbd_mem_set_huge_pages (mem_huge_pages_e mode);
+
+// Allocator counters. A block can be allocated by one thread and freed by another, so the counts for a single
+// thread don't necessarily add up. They do when they are summed over all threads.
+typedef struct mem_stats {
+    size_t   block_size;     // 0 when summed over size classes
+    uint64_t allocated;      // blocks allocated
+    uint64_t freed;          // blocks freed
+    int64_t  cached;         // free blocks that are ready to be allocated
+    int64_t  remote_pending; // blocks freed by a thread other than their owner that the owner hasn't taken back
+    uint64_t regions_mapped; // the region counts are per thread, so they are only filled in for size class -1
+    uint64_t bytes_mapped;
+    uint64_t bytes_released; // memory given back to the OS, with munmap() or madvise()
+} mem_stats_t;
+
+// Fill in <stats> for <thread_index> and <size_class>. Either can be -1 to sum over all threads or size classes.
+int  nbd_mem_num_size_classes (void);
+void nbd_mem_stats (mem_stats_t *stats, int thread_index, int size_class);
+
+// Sampled allocation profile. Once it is started, roughly one allocation in every <sample_bytes> allocated
+// bytes is recorded along with the tag it was allocated with. A <sample_bytes> of 0 stops the sampling.
+void nbd_mem_profile_start (size_t sample_bytes);
+void nbd_mem_profile_print (void);
+
+// Chunks are page sized, page aligned blocks for allocators that carve them up themselves, like the object pools
+// in pool.c. nbd_free() of anything inside a chunk is passed on to the chunk's owner. Pages are 2MB, except in
+// runtime/mem.c's 32 bit build, which uses 4KB pages. The makefile defines NBD_MEM2 for programs built with
+// runtime/mem2.c.
+#if defined(NBD32) && !defined(NBD_MEM2)
+#define MEM_CHUNK_SIZE (1ULL << 12)
+#else
+#define MEM_CHUNK_SIZE (1ULL << 21)
+#endif
+typedef struct mem_chunk_owner {
+    void (*free_) (struct mem_chunk_owner *owner, void *x);
+} mem_chunk_owner_t;
+void *mem_chunk_alloc (mem_chunk_owner_t *owner);
+void mem_chunk_free (void *chunk);
+
+extern size_t mem_sample_bytes_;
+void mem_sample (size_t n, const char *tag);
+
+static inline void *nbd_malloc_tagged (size_t n, const char *tag) {
+    if (EXPECT_FALSE(mem_sample_bytes_ != 0)) {
+        mem_sample(n, tag);
+    }
+    return nbd_malloc(n);
+}
+
+static inline void *nbd_aligned_alloc_tagged (size_t alignment, size_t n, const char *tag) {
+    if (EXPECT_FALSE(mem_sample_bytes_ != 0)) {
+        mem_sample(n, tag);
+    }
+    return nbd_aligned_alloc(alignment, n);
+}
 #endif//MEM_H
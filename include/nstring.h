@@ -13,6 +13,7 @@ nstring_t * ns_alloc (uint32_t len);
 int         ns_cmp   (const nstring_t *ns1, const nstring_t *ns2);
 uint32_t    ns_hash  (const nstring_t *ns);
 nstring_t * ns_dup   (const nstring_t *ns);
+size_t      ns_size  (const nstring_t *ns);
 
 extern const datatype_t DATATYPE_NSTRING;
 
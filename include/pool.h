@@ -0,0 +1,23 @@
+/* 
+ * Written by Josh Dybnis and released to the public domain, as explained at
+ * http://creativecommons.org/licenses/publicdomain
+ */
+#ifndef POOL_H
+#define POOL_H
+
+// A pool hands out objects of a single size. Objects can be returned with pool_free() or nbd_free(), so they
+// can be passed to rcu_defer_free() like any other block. Pools are never destroyed.
+typedef struct nbd_pool nbd_pool_t;
+
+nbd_pool_t *nbd_pool_create (size_t size);
+void *pool_alloc (nbd_pool_t *pool) __attribute__((malloc));
+void pool_free (nbd_pool_t *pool, void *x) __attribute__((nonnull(2)));
+
+// For pools kept in global variables. Returns *<pool>, creating it first if it doesn't exist yet.
+nbd_pool_t *pool_install (nbd_pool_t **pool, size_t size);
+static inline nbd_pool_t *nbd_pool_get (nbd_pool_t **pool, size_t size) {
+    nbd_pool_t *p = *pool;
+    return EXPECT_TRUE(p != NULL) ? p : pool_install(pool, size);
+}
+
+#endif//POOL_H
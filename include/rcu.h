@@ -5,7 +5,130 @@
 #ifndef RCU_H
 #define RCU_H
 
+#include "tls.h"
+
 void rcu_update (void);
 void rcu_defer_free (void *x);
 
+// Call <fn> on <x> once no thread can be holding a reference to it, instead of nbd_free(). It is for objects that
+// own other memory, like a node and its key, or a value that a map's caller took out of it. The callbacks are run
+// in batches, wherever the memory would have been freed: usually from rcu_update(), but also from rcu_defer_free()
+// and rcu_defer_call() when the thread's queue is full. They run on whichever thread ends up with <x>, and they can
+// defer more memory themselves.
+void rcu_defer_call (void *x, free_t fn);
+
+// Brackets code that can hold references to memory other threads free with rcu_defer_free(). They nest. The map
+// and txn interfaces already use them, so they are only needed around direct use of the data structures, and
+// around using memory that a map call returned.
+//
+// Leaving the outermost critical section is a quiescent state, so every so often rcu_leave() calls rcu_update()
+// itself (see rcu_set_update_interval()). That way threads that only use the map and txn interfaces don't have to
+// call rcu_update() at all. It also means a map call doesn't protect what it returns once it is over. A thread
+// that gets memory out of a map and then uses it has to do both inside its own rcu_enter() and rcu_leave().
+extern DECLARE_THREAD_LOCAL(RcuDepth, int);
+extern DECLARE_THREAD_LOCAL(RcuCountdown, int);
+
+void rcu_quiescent (void);
+
+#ifdef RCU_IBR
+// Interval-based reclamation (runtime/ibr.c). The map code has to be compiled with RCU_IBR defined to use it, which
+// the makefile does when runtime/ibr.c is in a program's sources.
+//
+// There is a global era that moves forward as memory is freed. Between rcu_enter() and rcu_leave() a thread
+// reserves the interval of eras from when it entered to the last time it loaded a pointer with rcu_load(). Memory
+// that is passed to rcu_defer_free_born() with the era it was allocated in is only held up by threads whose
+// interval overlaps its lifetime. So a thread that stalls in a critical section doesn't hold up memory allocated
+// after that, which is most of it. rcu_defer_free() assumes the memory is as old as it can be, like ebr.c does.
+//
+// Memory that is passed to rcu_defer_free_born() must only be reached through pointers loaded with rcu_load().
+// That costs a load and a compare, except when the era has changed since the thread's last rcu_load(). Then the
+// thread extends its interval, which takes a memory barrier.
+extern uint64_t RcuEra;
+extern DECLARE_THREAD_LOCAL(RcuUpper, uint64_t);
+
+void rcu_begin_interval  (void);
+void rcu_end_interval    (void);
+void rcu_extend_interval (uint64_t era);
+void rcu_defer_free_born (void *x, uint64_t birth);
+void rcu_defer_call_born (void *x, free_t fn, uint64_t birth);
+
+static inline uint64_t rcu_era (void) {
+    return *(volatile uint64_t *)&RcuEra;
+}
+
+static inline int rcu_era_reserved (void) {
+    uint64_t era = rcu_era();
+    LOCALIZE_THREAD_LOCAL(RcuUpper, uint64_t);
+    if (__builtin_expect(era == RcuUpper, 1))
+        return 1;
+    rcu_extend_interval(era);
+    return 0;
+}
+
+#define rcu_load(p) ({ typeof(*(p)) x_; do { x_ = *(volatile typeof(p))(p); } while (!rcu_era_reserved()); x_; })
+#else
+// Without RCU_IBR these are plain loads and frees, and the era arguments aren't evaluated.
+#define rcu_load(p) (*(p))
+#define rcu_era() 0
+#define rcu_defer_free_born(x, birth) rcu_defer_free(x)
+#define rcu_defer_call_born(x, fn, birth) rcu_defer_call(x, fn)
+#endif
+
+static inline void rcu_enter (void) {
+    LOCALIZE_THREAD_LOCAL(RcuDepth, int);
+#ifdef RCU_IBR
+    if (RcuDepth == 0) {
+        rcu_begin_interval();
+    }
+#endif
+    SET_THREAD_LOCAL(RcuDepth, RcuDepth + 1);
+    __asm__ __volatile__("" ::: "memory"); // the stall signal handler runs on this thread
+}
+
+static inline void rcu_leave (void) {
+    __asm__ __volatile__("" ::: "memory");
+    LOCALIZE_THREAD_LOCAL(RcuDepth, int);
+    SET_THREAD_LOCAL(RcuDepth, RcuDepth - 1);
+    if (RcuDepth == 0) {
+#ifdef RCU_IBR
+        rcu_end_interval();
+#endif
+        LOCALIZE_THREAD_LOCAL(RcuCountdown, int);
+        SET_THREAD_LOCAL(RcuCountdown, RcuCountdown - 1);
+        if (__builtin_expect(RcuCountdown <= 0, 0)) {
+            rcu_quiescent();
+        }
+    }
+}
+
+// Call rcu_update() from rcu_leave() once every <n> critical sections on the calling thread. An <n> of 0 turns it
+// off for the thread, for example if it relies on memory it got out of a map staying around between calls. The
+// default is RCU_UPDATE_INTERVAL.
+#define RCU_UPDATE_INTERVAL 32
+void rcu_set_update_interval (int n);
+
+// Let reclamation get past threads that stop calling rcu_update(). A thread that hasn't called it in <ms>
+// milliseconds is sent RCU_STALL_SIGNAL. If it isn't between rcu_enter() and rcu_leave() when the signal arrives,
+// it passes through a quiescent state in the signal handler. A thread that is blocked in a system call is woken
+// up for that, so some calls can fail with EINTR. Only use this if everything that rcu_defer_free() is used to
+// protect is accessed between rcu_enter() and rcu_leave(). An <ms> of 0 turns it off, which is the default.
+#define RCU_STALL_SIGNAL SIGURG
+void rcu_set_stall_timeout (int ms);
+
+// Reclamation counters. The counts for a single thread stay with its thread index.
+typedef struct rcu_stats {
+    uint64_t deferred;    // objects passed to rcu_defer_free() or rcu_defer_call()
+    uint64_t pending;     // objects waiting to be freed
+    uint64_t orphaned;    // objects left behind by threads that exited, waiting to be taken over (in pending)
+    uint64_t max_pending; // the most objects a single thread has had waiting to be freed
+    uint64_t grows;       // times a thread's queue filled up and was made bigger
+    uint64_t waits;       // times a thread had to wait for room because its queue was full and at the limit
+    uint64_t overflows;   // times a thread gave up waiting and grew its queue past the limit
+    uint64_t stalls;      // times a thread was found to have stopped calling rcu_update()
+    uint64_t neutralized; // times a stalled thread passed through a quiescent state from the signal handler
+} rcu_stats_t;
+
+// A <thread_index> of -1 means all threads.
+void rcu_stats (rcu_stats_t *stats, int thread_index);
+
 #endif//RCU_H
@@ -9,6 +9,12 @@
 #include "tls.h"
 
 void nbd_thread_init (void);
+int nbd_thread_try_init (void); // returns FALSE instead of failing when there are no thread ids left
+// Gives up the thread's id. The thread must not use any nbds structures afterwards. A thread that ends without
+// calling it calls it from a pthread key destructor.
+void nbd_thread_exit (void);
+int nbd_max_threads (void); // the number of thread ids, from NBD_MAX_THREADS in the environment or the number of CPUs
+int nbd_thread_index (void); // the calling thread's id minus 1, for indexing per-thread arrays of nbd_max_threads()
 uint64_t nbd_rand (void);
 
 #endif//RUNTIME_H
@@ -18,8 +18,13 @@
 #include "common.h"
 #include "murmur.h"
 #include "mem.h"
+#include "pool.h"
+#include "arena.h"
 #include "rcu.h"
 #include "hashtable.h"
+#ifdef HT_USE_HAZARD_POINTER
+#include "hazard.h"
+#endif
 
 #ifndef NBD32
 #define GET_PTR(x) ((void *)((x) & MASK(48))) // low-order 48 bits is a pointer to a nstring_t
@@ -36,9 +41,6 @@ typedef struct hti {
     volatile entry_t *table;
     hashtable_t *ht; // parent ht;
     struct hti *next;
-#ifdef USE_SYSTEM_MALLOC
-    void *unaligned_table_ptr; // system malloc doesn't guarentee cache-line alignment
-#endif
     size_t count; // TODO: make these counters distributed
     size_t key_count;
     size_t copy_scan;
@@ -46,6 +48,10 @@ typedef struct hti {
     int probe;
     int ref_count;
     uint8_t scale;
+    uint8_t free_keys; // the keys are freed along with the table
+#ifdef RCU_IBR
+    uint64_t birth; // the era the hti and its table were allocated in
+#endif
 } hti_t;
 
 struct ht_iter {
@@ -59,6 +65,9 @@ struct ht {
     uint32_t hti_copies;
     double density;
     int probe;
+    nbd_arena_t *arena; // if not NULL, the hti's and keys come from here and are never freed individually
+    int keys_in_arena;
+    map_counters_t *counters;
 };
 
 static const map_val_t COPIED_VALUE          = TAG_VALUE(DOES_NOT_EXIST, TAG1);
@@ -70,6 +79,32 @@ static const unsigned MIN_SCALE              = 4; // min 16 entries (4 buckets)
 
 static int hti_copy_entry (hti_t *ht1, volatile entry_t *ent, uint32_t ent_key_hash, hti_t *ht2);
 
+// Static hazard pointers used by the hashtable.
+#define HAZ_HTI   0
+#define HAZ_COUNT 1 // ht_count() is called in the middle of other operations
+
+// Returns the first table in <ht>. With hazard pointers it is protected by the static hazard pointer <n>. That
+// protects the tables after it too, because a table isn't freed until the one before it is (see hti_free()).
+static hti_t *get_hti (hashtable_t *ht, int n) {
+#ifdef HT_USE_HAZARD_POINTER
+    haz_t *hp = haz_get_static(n);
+    hti_t *hti;
+    do {
+        hti = VOLATILE_DEREF(ht).hti;
+        haz_set(hp, hti);
+    } while (hti != VOLATILE_DEREF(ht).hti);
+    return hti;
+#else
+    return rcu_load(&ht->hti);
+#endif
+}
+
+// Returns the table after <hti>. The tables are born later than the ones before them, so each hop has to be
+// covered by the thread's reservation under interval-based reclamation (see rcu_load()).
+static inline hti_t *next_hti (hti_t *hti) {
+    return rcu_load((hti_t * volatile *)&hti->next);
+}
+
 // Choose the next bucket to probe using the high-order bits of <key_hash>.
 static inline int get_next_ndx(int old_ndx, uint32_t key_hash, int ht_scale) {
 #if 1
@@ -146,17 +181,18 @@ static volatile entry_t *hti_lookup (hti_t *hti, map_key_t key, uint32_t key_has
 
 // Allocate and initialize a hti_t with 2^<scale> entries.
 static hti_t *hti_alloc (hashtable_t *parent, int scale) {
-    hti_t *hti = (hti_t *)nbd_malloc(sizeof(hti_t));
+    // The tables are too big for an arena and are always freed individually. So are the hti's, because they are
+    // freed along with their tables, which can be after the arena is gone.
+    hti_t *hti = (hti_t *)nbd_malloc_tagged(sizeof(hti_t), "hti");
     memset(hti, 0, sizeof(hti_t));
     hti->scale = scale;
+#ifdef RCU_IBR
+    hti->birth = rcu_era();
+#endif
+    hti->free_keys = (parent->key_type != NULL && !parent->keys_in_arena);
 
     size_t sz = sizeof(entry_t) * (1ULL << scale);
-#ifdef USE_SYSTEM_MALLOC
-    hti->unaligned_table_ptr = nbd_malloc(sz + CACHE_LINE_SIZE - 1);
-    hti->table = (void *)(((size_t)hti->unaligned_table_ptr + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1));
-#else
-    hti->table = nbd_malloc(sz);
-#endif
+    hti->table = nbd_aligned_alloc_tagged(CACHE_LINE_SIZE, sz, "hti table");
     memset((void *)hti->table, 0, sz);
 
     hti->probe = (int)(hti->scale * 1.5) + 2;
@@ -189,15 +225,13 @@ static void hti_start_copy (hti_t *hti) {
 
     // Allocate the new table and attempt to install it.
     hti_t *next = hti_alloc(hti->ht, new_scale);
+    next->ref_count++; // one for <hti>
     hti_t *old_next = SYNC_CAS(&hti->next, NULL, next);
     if (old_next != NULL) {
         // Another thread beat us to it.
         TRACE("h0", "hti_start_copy: lost race to install new hti; found %p", old_next, 0);
-#ifdef USE_SYSTEM_MALLOC
-        nbd_free(next->unaligned_table_ptr);
-#else
-        nbd_free((void *)next->table);
-#endif
+        nbd_free((void *)next->table); // it came from nbd_aligned_alloc(), so it can't be freed by size
+        nbd_free_sized(next, sizeof(hti_t));
         return;
     }
     TRACE("h0", "hti_start_copy: new hti %p scale %llu", next, next->scale);
@@ -272,7 +306,7 @@ static int hti_copy_entry (hti_t *ht1, volatile entry_t *ht1_ent, uint32_t key_h
         if (ht2->next == NULL) {
             hti_start_copy(ht2); // initiate nested copy, if not already started
         }
-        return hti_copy_entry(ht1, ht1_ent, key_hash, ht2->next); // recursive tail-call
+        return hti_copy_entry(ht1, ht1_ent, key_hash, next_hti(ht2)); // recursive tail-call
     }
 
     if (ht2_ent_is_empty) {
@@ -292,7 +326,7 @@ static int hti_copy_entry (hti_t *ht1, volatile entry_t *ht1_ent, uint32_t key_h
     // If there is a nested copy in progress, we might have installed the key into a dead entry.
     if (old_ht2_ent_val == COPIED_VALUE) {
         TRACE("h0", "hti_copy_entry: nested copy in progress; copy %p to next table %p", ht2_ent, ht2->next);
-        return hti_copy_entry(ht1, ht1_ent, key_hash, ht2->next); // recursive tail-call
+        return hti_copy_entry(ht1, ht1_ent, key_hash, next_hti(ht2)); // recursive tail-call
     }
 
     // Mark the old entry as dead.
@@ -354,9 +388,14 @@ static map_val_t hti_cas (hti_t *hti, map_key_t key, uint32_t key_hash, map_val_
             return DOES_NOT_EXIST;
 
         // Allocate <new_key>.
-        map_key_t new_key = (hti->ht->key_type == NULL)
-                          ? (map_key_t)key
-                          : (map_key_t)hti->ht->key_type->clone((void *)key);
+        map_key_t new_key;
+        if (hti->ht->key_type == NULL) {
+            new_key = (map_key_t)key;
+        } else if (hti->ht->arena != NULL) {
+            new_key = (map_key_t)arena_clone(hti->ht->arena, hti->ht->key_type, (void *)key);
+        } else {
+            new_key = (map_key_t)hti->ht->key_type->clone((void *)key);
+        }
 #ifndef NBD32
         if (EXPECT_FALSE(hti->ht->key_type != NULL)) {
             // Combine <new_key> pointer with bits from its hash
@@ -372,9 +411,10 @@ static map_val_t hti_cas (hti_t *hti, map_key_t key, uint32_t key_hash, map_val_
             TRACE("h0", "hti_cas: lost race to install key %p in entry %p", new_key, ent);
             TRACE("h0", "hti_cas: found %p instead of NULL",
                         (hti->ht->key_type == NULL) ? (void *)old_ent_key : GET_PTR(old_ent_key), 0);
-            if (hti->ht->key_type != NULL) {
+            if (hti->ht->key_type != NULL && !hti->ht->keys_in_arena) {
                 nbd_free(GET_PTR(new_key));
             }
+            MAP_COUNT(hti->ht->counters, cas_failures, 1);
             return hti_cas(hti, key, key_hash, expected, new); // tail-call
         }
         TRACE("h2", "hti_cas: installed key %p in entry %p", new_key, ent);
@@ -388,9 +428,10 @@ static map_val_t hti_cas (hti_t *hti, map_key_t key, uint32_t key_hash, map_val_
     map_val_t ent_val = ent->val;
     if (EXPECT_FALSE(IS_TAGGED(ent_val, TAG1))) {
         if (ent_val != COPIED_VALUE && ent_val != TAG_VALUE(TOMBSTONE, TAG1)) {
-            int did_copy = hti_copy_entry(hti, ent, key_hash, VOLATILE_DEREF(hti).next);
+            int did_copy = hti_copy_entry(hti, ent, key_hash, next_hti(hti));
             if (did_copy) {
                 (void)SYNC_ADD(&hti->num_entries_copied, 1);
+                MAP_COUNT(hti->ht->counters, copy_help, 1);
             }
             TRACE("h0", "hti_cas: value in the middle of a copy, copy completed by %s",
                         (did_copy ? "self" : "other"), 0);
@@ -419,6 +460,7 @@ static map_val_t hti_cas (hti_t *hti, map_key_t key, uint32_t key_hash, map_val_
     map_val_t v = SYNC_CAS(&ent->val, ent_val, new == DOES_NOT_EXIST ? TOMBSTONE : new);
     if (EXPECT_FALSE(v != ent_val)) {
         TRACE("h0", "hti_cas: value CAS failed; expected %p found %p", ent_val, v);
+        MAP_COUNT(hti->ht->counters, cas_failures, 1);
         return hti_cas(hti, key, key_hash, expected, new); // recursive tail-call
     }
 
@@ -444,7 +486,7 @@ static map_val_t hti_get (hti_t *hti, map_key_t key, uint32_t key_hash) {
     // might exist in the copy.
     if (EXPECT_FALSE(ent == NULL)) {
         if (VOLATILE_DEREF(hti).next != NULL)
-            return hti_get(hti->next, key, key_hash); // recursive tail-call
+            return hti_get(next_hti(hti), key, key_hash); // recursive tail-call
         return DOES_NOT_EXIST;
     }
 
@@ -455,12 +497,13 @@ static map_val_t hti_get (hti_t *hti, map_key_t key, uint32_t key_hash) {
     map_val_t ent_val = ent->val;
     if (EXPECT_FALSE(IS_TAGGED(ent_val, TAG1))) {
         if (EXPECT_FALSE(ent_val != COPIED_VALUE && ent_val != TAG_VALUE(TOMBSTONE, TAG1))) {
-            int did_copy = hti_copy_entry(hti, ent, key_hash, VOLATILE_DEREF(hti).next);
+            int did_copy = hti_copy_entry(hti, ent, key_hash, next_hti(hti));
             if (did_copy) {
                 (void)SYNC_ADD(&hti->num_entries_copied, 1);
+                MAP_COUNT(hti->ht->counters, copy_help, 1);
             }
         }
-        return hti_get(VOLATILE_DEREF(hti).next, key, key_hash); // tail-call
+        return hti_get(next_hti(hti), key, key_hash); // tail-call
     }
 
     return (ent_val == TOMBSTONE) ? DOES_NOT_EXIST : ent_val;
@@ -473,7 +516,7 @@ map_val_t ht_get (hashtable_t *ht, map_key_t key) {
 #else
     uint32_t hash = (ht->key_type == NULL) ? murmur32_8b((uint64_t)key) : ht->key_type->hash((void *)key);
 #endif
-    return hti_get(ht->hti, key, hash);
+    return hti_get(get_hti(ht, HAZ_HTI), key, hash);
 }
 
 // returns TRUE if copy is done
@@ -508,36 +551,58 @@ static int hti_help_copy (hti_t *hti) {
 
         // Copy the entries
         for (int i = 0; i < limit; ++i) {
-            num_copied += hti_copy_entry(hti, ent++, 0, hti->next);
+            num_copied += hti_copy_entry(hti, ent++, 0, next_hti(hti));
             assert(ent <= hti->table + (1ULL << hti->scale));
         }
         if (num_copied != 0) {
             total_copied = SYNC_ADD(&hti->num_entries_copied, num_copied);
+            MAP_COUNT(hti->ht->counters, copy_help, num_copied);
         }
     }
 
     return (total_copied == (1ULL << hti->scale));
 }
 
-static void hti_defer_free (hti_t *hti) {
-    assert(hti->ref_count == 0);
+static void hti_release (hti_t *hti);
 
-    for (uint32_t i = 0; i < (1ULL << hti->scale); ++i) {
+// Called once no thread can be looking at <hti>, with its table and the keys that weren't copied out of it. With
+// hazard pointers no thread can get to the next table through <hti> either, so <hti> lets go of it here.
+static void hti_free (hti_t *hti) {
+#ifdef HT_USE_HAZARD_POINTER
+    hti_t *next = hti->next;
+#endif
+    for (uint32_t i = 0; i < (1ULL << hti->scale) && hti->free_keys; ++i) {
         map_key_t key = hti->table[i].key;
         map_val_t val = hti->table[i].val;
         if (val == COPIED_VALUE)
             continue;
         assert(!IS_TAGGED(val, TAG1) || val == TAG_VALUE(TOMBSTONE, TAG1)); // copy not in progress
-        if (hti->ht->key_type != NULL && key != DOES_NOT_EXIST) {
-            rcu_defer_free(GET_PTR(key));
+        if (key != DOES_NOT_EXIST) {
+            nbd_free(GET_PTR(key));
         }
     }
-#ifdef USE_SYSTEM_MALLOC
-    rcu_defer_free(hti->unaligned_table_ptr);
+    nbd_free((void *)hti->table);
+    nbd_free(hti);
+#ifdef HT_USE_HAZARD_POINTER
+    if (next != NULL) {
+        hti_release(next);
+    }
+#endif
+}
+
+static void hti_defer_free (hti_t *hti) {
+    assert(hti->ref_count == 0);
+#ifdef HT_USE_HAZARD_POINTER
+    haz_defer_free(hti, (free_t)hti_free);
 #else
-    rcu_defer_free((void *)hti->table);
+    // Keys move from table to table, so they can be older than <hti>. Its birth only covers them if it has none.
+    hti_t *next = hti->next;
+    rcu_defer_call_born(hti, (free_t)hti_free, hti->free_keys ? 0 : hti->birth);
+    // Threads that can still get to the next table through <hti> are in critical sections.
+    if (next != NULL) {
+        hti_release(next);
+    }
 #endif
-    rcu_defer_free(hti);
 }
 
 static void hti_release (hti_t *hti) {
@@ -556,7 +621,7 @@ map_val_t ht_cas (hashtable_t *ht, map_key_t key, map_val_t expected_val, map_va
     assert(key != DOES_NOT_EXIST);
     assert(!IS_TAGGED(new_val, TAG1) && new_val != DOES_NOT_EXIST && new_val != TOMBSTONE);
 
-    hti_t *hti = ht->hti;
+    hti_t *hti = get_hti(ht, HAZ_HTI);
 
     // Help with an ongoing copy.
     if (EXPECT_FALSE(hti->next != NULL)) {
@@ -565,7 +630,9 @@ map_val_t ht_cas (hashtable_t *ht, map_key_t key, map_val_t expected_val, map_va
         // Unlink fully copied tables.
         if (done) {
             assert(hti->next);
-            if (SYNC_CAS(&ht->hti, hti, hti->next) == hti) {
+            if (SYNC_CAS(&ht->hti, hti, next_hti(hti)) == hti) {
+                TRACE("h0", "ht_cas: copy to hti %p is done; unlinked old hti %p", hti->next, hti);
+                MAP_COUNT(ht->counters, unlink_assists, 1);
                 hti_release(hti);
             }
         }
@@ -579,7 +646,8 @@ map_val_t ht_cas (hashtable_t *ht, map_key_t key, map_val_t expected_val, map_va
 #endif
     while ((old_val = hti_cas(hti, key, key_hash, expected_val, new_val)) == COPIED_VALUE) {
         assert(hti->next);
-        hti = hti->next;
+        MAP_COUNT(ht->counters, restarts, 1);
+        hti = next_hti(hti);
     }
 
     return old_val == TOMBSTONE ? DOES_NOT_EXIST : old_val;
@@ -588,7 +656,7 @@ map_val_t ht_cas (hashtable_t *ht, map_key_t key, map_val_t expected_val, map_va
 // Remove the value in <ht> associated with <key>. Returns the value removed, or DOES_NOT_EXIST if there was
 // no value for that key.
 map_val_t ht_remove (hashtable_t *ht, map_key_t key) {
-    hti_t *hti = ht->hti;
+    hti_t *hti = get_hti(ht, HAZ_HTI);
     map_val_t val;
 #ifdef NBD32
     uint32_t key_hash = (ht->key_type == NULL) ? murmur32_4b((uint64_t)key) : ht->key_type->hash((void *)key);
@@ -600,26 +668,39 @@ map_val_t ht_remove (hashtable_t *ht, map_key_t key) {
         if (val != COPIED_VALUE)
             return val == TOMBSTONE ? DOES_NOT_EXIST : val;
         assert(hti->next);
-        hti = hti->next;
+        MAP_COUNT(ht->counters, restarts, 1);
+        hti = next_hti(hti);
         assert(hti);
     } while (1);
 }
 
+map_counters_t *ht_counters (hashtable_t *ht) {
+    return ht->counters;
+}
+
 // Returns the number of key-values pairs in <ht>
 size_t ht_count (hashtable_t *ht) {
-    hti_t *hti = ht->hti;
+    hti_t *hti = get_hti(ht, HAZ_COUNT);
     size_t count = 0;
     while (hti) {
         count += hti->count;
-        hti = hti->next;
+        hti = next_hti(hti);
     }
     return count;
 }
 
 // Allocate and initialize a new hash table.
 hashtable_t *ht_alloc (const datatype_t *key_type) {
-    hashtable_t *ht = nbd_malloc(sizeof(hashtable_t));
+    return ht_alloc_arena(key_type, NULL);
+}
+
+// Allocate a new hash table whose keys and bookkeeping live in <arena>. The arena is released by ht_free().
+hashtable_t *ht_alloc_arena (const datatype_t *key_type, nbd_arena_t *arena) {
+    hashtable_t *ht = (arena != NULL) ? arena_alloc(arena, sizeof(hashtable_t)) : nbd_malloc(sizeof(hashtable_t));
     ht->key_type = key_type;
+    ht->arena = arena;
+    ht->keys_in_arena = (arena != NULL && key_type != NULL && key_type->size != NULL);
+    ht->counters = map_counters_alloc();
     ht->hti = (hti_t *)hti_alloc(ht, MIN_SCALE);
     ht->hti_copies = 0;
     ht->density = 0.0;
@@ -631,16 +712,21 @@ void ht_free (hashtable_t *ht) {
     hti_t *hti = ht->hti;
     do {
         hti_t *next = hti->next;
-        assert(hti->ref_count == 1);
+        assert(hti->ref_count >= 1); // the one before it can still be waiting to be freed
         hti_release(hti);
         hti = next;
     } while (hti);
-    nbd_free(ht);
+    map_counters_free(ht->counters);
+    if (ht->arena != NULL) {
+        nbd_arena_free(ht->arena);
+    } else {
+        nbd_free_sized(ht, sizeof(hashtable_t));
+    }
 }
 
 void ht_print (hashtable_t *ht, int verbose) {
     printf("probe:%-2d density:%.1f%% count:%-8lld ", ht->probe, ht->density, (uint64_t)ht_count(ht));
-    hti_t *hti = ht->hti;
+    hti_t *hti = get_hti(ht, HAZ_HTI);
     while (hti) {
         if (verbose) {
             for (int i = 0; i < (1ULL << hti->scale); ++i) {
@@ -660,14 +746,16 @@ void ht_print (hashtable_t *ht, int verbose) {
     }
 }
 
+static nbd_pool_t *iter_pool_ = NULL;
+
 ht_iter_t *ht_iter_begin (hashtable_t *ht, map_key_t key) {
     hti_t *hti;
     int ref_count;
     do {
-        hti = ht->hti;
+        hti = get_hti(ht, HAZ_HTI);
         while (hti->next != NULL) {
             do { } while (hti_help_copy(hti) != TRUE);
-            hti = hti->next;
+            hti = next_hti(hti);
         }
         do {
             ref_count = hti->ref_count;
@@ -676,7 +764,7 @@ ht_iter_t *ht_iter_begin (hashtable_t *ht, map_key_t key) {
         } while (ref_count != SYNC_CAS(&hti->ref_count, ref_count, ref_count + 1));
     } while (ref_count == 0);
 
-    ht_iter_t *iter = nbd_malloc(sizeof(ht_iter_t));
+    ht_iter_t *iter = pool_alloc(nbd_pool_get(&iter_pool_, sizeof(ht_iter_t)));
     iter->hti = hti;
     iter->idx = -1;
 
@@ -706,7 +794,7 @@ map_val_t ht_iter_next (ht_iter_t *iter, map_key_t *key_ptr) {
 #else
         uint32_t hash = (key_type == NULL) ? murmur32_8b((uint64_t)key) : key_type->hash((void *)key);
 #endif
-        val = hti_get(iter->hti->next, (map_key_t)ent->key, hash);
+        val = hti_get(next_hti(iter->hti), (map_key_t)ent->key, hash);
 
         // Go to the next entry if key is already deleted.
         if (val == DOES_NOT_EXIST)
@@ -719,7 +807,12 @@ map_val_t ht_iter_next (ht_iter_t *iter, map_key_t *key_ptr) {
     return val;
 }
 
+// The iterator's table is reference counted, and it keeps the tables after it around too, so the iterator doesn't
+// need to be in a critical section between calls.
+void ht_iter_yield (ht_iter_t *iter) {
+}
+
 void ht_iter_free (ht_iter_t *iter) {
     hti_release(iter->hti);
-    nbd_free(iter);
+    pool_free(iter_pool_, iter);
 }
@@ -12,25 +12,35 @@
 #include "common.h"
 #include "list.h"
 #include "mem.h"
+#include "pool.h"
+#include "arena.h"
+#include "rcu.h"
 #ifdef LIST_USE_HAZARD_POINTER
 #include "hazard.h"
-#else
-#include "rcu.h"
 #endif
 
 typedef struct node {
     map_key_t  key;
     map_val_t  val;
     markable_t next; // next node
+#ifdef RCU_IBR
+    uint64_t   birth; // the era the node was allocated in
+#endif
 } node_t;
 
 struct ll_iter {
     node_t *pred;
+    list_t *ll;
+    map_key_t key; // where to resume after ll_iter_yield(), if <pred> is NULL
+    int paused;
 };
 
 struct ll {
     node_t *head;
     const datatype_t *key_type;
+    nbd_arena_t *arena; // if not NULL, the nodes come from here and are never freed individually
+    int keys_in_arena;
+    map_counters_t *counters;
 };
 
 // Marking the <next> field of a node logically removes it from the list
@@ -39,79 +49,156 @@ struct ll {
 #define   GET_NODE(x) ((node_t *)(x))
 #define STRIP_MARK(x) ((node_t *)STRIP_TAG((x), 0x1))
 
-static node_t *node_alloc (map_key_t key, map_val_t val) {
-    node_t *item = (node_t *)nbd_malloc(sizeof(node_t));
+static nbd_pool_t *node_pool_ = NULL; // shared by all lists
+
+static node_t *node_alloc (list_t *ll, map_key_t key, map_val_t val) {
+    node_t *item;
+    if (ll->arena != NULL) {
+        item = (node_t *)arena_alloc(ll->arena, sizeof(node_t));
+    } else {
+        item = (node_t *)pool_alloc(nbd_pool_get(&node_pool_, sizeof(node_t)));
+    }
     assert(!HAS_MARK((size_t)item));
     item->key = key;
     item->val = val;
+#ifdef RCU_IBR
+    item->birth = rcu_era();
+#endif
     return item;
 }
 
+static map_key_t clone_key (list_t *ll, map_key_t key) {
+    if (ll->key_type == NULL)
+        return key;
+    if (ll->arena != NULL)
+        return (map_key_t)arena_clone(ll->arena, ll->key_type, (void *)key);
+    return (map_key_t)ll->key_type->clone((void *)key);
+}
+
 list_t *ll_alloc (const datatype_t *key_type) {
-    list_t *ll = (list_t *)nbd_malloc(sizeof(list_t));
+    return ll_alloc_arena(key_type, NULL);
+}
+
+list_t *ll_alloc_arena (const datatype_t *key_type, nbd_arena_t *arena) {
+    list_t *ll;
+    if (arena != NULL) {
+        ll = (list_t *)arena_alloc(arena, sizeof(list_t));
+    } else {
+        ll = (list_t *)nbd_malloc(sizeof(list_t));
+    }
     ll->key_type = key_type;
-    ll->head = node_alloc(0, 0);
+    ll->arena = arena;
+    ll->keys_in_arena = (arena != NULL && key_type != NULL && key_type->size != NULL);
+    ll->counters = map_counters_alloc();
+    ll->head = node_alloc(ll, 0, 0);
     ll->head->next = DOES_NOT_EXIST;
     return ll;
 }
 
 void ll_free (list_t *ll) {
+    map_counters_free(ll->counters);
+    if (ll->arena != NULL && (ll->key_type == NULL || ll->keys_in_arena)) {
+        nbd_arena_free(ll->arena);
+        return;
+    }
     node_t *item = STRIP_MARK(ll->head->next);
     while (item != NULL) {
         node_t *next = STRIP_MARK(item->next);
-        if (ll->key_type != NULL) {
+        if (ll->key_type != NULL && !ll->keys_in_arena) {
             nbd_free((void *)item->key);
         }
-        nbd_free(item);
+        if (ll->arena == NULL) {
+            nbd_free(item);
+        }
         item = next;
     }
+    if (ll->arena != NULL) {
+        nbd_arena_free(ll->arena);
+    }
+}
+
+map_counters_t *ll_counters (list_t *ll) {
+    return ll->counters;
 }
 
 size_t ll_count (list_t *ll) {
     size_t count = 0;
-    node_t *item = STRIP_MARK(ll->head->next);
+    node_t *item = STRIP_MARK(rcu_load(&ll->head->next));
     while (item) {
         if (!HAS_MARK(item->next)) {
             count++;
         }
-        item = STRIP_MARK(item->next);
+        item = STRIP_MARK(rcu_load(&item->next));
     }
     return count;
 }
 
-#ifdef LIST_USE_HAZARD_POINTER
 static void nbd_free_node (node_t *x) {
     nbd_free((void *)x->key);
     nbd_free(x);
 }
+
+// Free <item> and its key once no thread can be looking at them. They go in the same deferred record.
+static void defer_free_node (list_t *ll, node_t *item) {
+    int free_key = (ll->key_type != NULL && !ll->keys_in_arena);
+    if (ll->arena == NULL) {
+#ifdef LIST_USE_HAZARD_POINTER
+        haz_defer_free(item, free_key ? (free_t)nbd_free_node : nbd_free);
+#else
+        if (free_key) {
+            rcu_defer_call_born(item, (free_t)nbd_free_node, item->birth);
+        } else {
+            rcu_defer_free_born(item, item->birth);
+        }
+#endif
+    } else if (free_key) {
+#ifdef LIST_USE_HAZARD_POINTER
+        haz_defer_free((void *)item->key, nbd_free);
+#else
+        rcu_defer_free_born((void *)item->key, item->birth);
+#endif
+    }
+}
+
+#ifdef LIST_USE_HAZARD_POINTER
+
+// Publish a hazard pointer to <item> and check that it is still linked from <pred>. If <pred> has been marked it
+// could already be unlinked, and then <item> could be freed even though <pred> still points to it.
+static inline int protect_item (haz_t *hp, node_t *pred, node_t *item) {
+    haz_set(hp, item);
+    return VOLATILE_DEREF(pred).next == (markable_t)item;
+}
 #endif
 
 static int find_pred (node_t **pred_ptr, node_t **item_ptr, list_t *ll, map_key_t key, int help_remove) {
     node_t *pred = ll->head;
-    node_t *item = GET_NODE(pred->next);
+    node_t *item = GET_NODE(rcu_load(&pred->next));
     TRACE("l2", "find_pred: searching for key %p in list (head is %p)", key, pred);
 #ifdef LIST_USE_HAZARD_POINTER
+    // Skipping over a removed item means following its link, which isn't safe once it could be unlinked.
+    help_remove = TRUE;
     haz_t *temp, *hp0 = haz_get_static(0), *hp1 = haz_get_static(1);
 #endif
 
     while (item != NULL) {
 #ifdef LIST_USE_HAZARD_POINTER
-        haz_set(hp0, item);
-        if (STRIP_MARK(pred->next) != item)
+        if (!protect_item(hp0, pred, item)) {
+            MAP_COUNT(ll->counters, restarts, 1);
             return find_pred(pred_ptr, item_ptr, ll, key, help_remove); // retry
+        }
 #endif
-        markable_t next = item->next;
+        markable_t next = rcu_load(&item->next);
 
         // A mark means the node is logically removed but not physically unlinked yet.
         while (EXPECT_FALSE(HAS_MARK(next))) {
 
             // Skip over logically removed items.
             if (!help_remove) {
-                item = STRIP_MARK(item->next);
+                item = STRIP_MARK(rcu_load(&item->next));
                 if (EXPECT_FALSE(item == NULL))
                     break;
                 TRACE("l3", "find_pred: skipping marked item %p (next is %p)", item, next);
-                next = item->next;
+                next = rcu_load(&item->next);
                 continue;
             }
 
@@ -121,27 +208,39 @@ static int find_pred (node_t **pred_ptr, node_t **item_ptr, list_t *ll, map_key_
             markable_t other = SYNC_CAS(&pred->next, (markable_t)item, (markable_t)STRIP_MARK(next));
             if (other == (markable_t)item) {
                 TRACE("l2", "find_pred: unlinked item %p from pred %p", item, pred);
+                MAP_COUNT(ll->counters, unlink_assists, 1);
                 item = STRIP_MARK(next);
-                next = (item != NULL) ? item->next : DOES_NOT_EXIST;
-                TRACE("l3", "find_pred: now current item is %p next is %p", item, next);
 
                 // The thread that completes the unlink should free the memory.
+                defer_free_node(ll, GET_NODE(other));
 #ifdef LIST_USE_HAZARD_POINTER
-                free_t free_ = (ll->key_type != NULL ? (free_t)nbd_free_node : nbd_free);
-                haz_defer_free(GET_NODE(other), free_);
-#else
-                if (ll->key_type != NULL) {
-                    rcu_defer_free((void *)GET_NODE(other)->key);
+                if (item != NULL && !protect_item(hp0, pred, item)) {
+                    MAP_COUNT(ll->counters, restarts, 1);
+                    return find_pred(pred_ptr, item_ptr, ll, key, help_remove); // retry
                 }
-                rcu_defer_free(GET_NODE(other));
 #endif
+                next = (item != NULL) ? rcu_load(&item->next) : DOES_NOT_EXIST;
+                TRACE("l3", "find_pred: now current item is %p next is %p", item, next);
             } else {
                 TRACE("l2", "find_pred: lost a race to unlink item %p from pred %p", item, pred);
                 TRACE("l2", "find_pred: pred's link changed to %p", other, 0);
-                if (HAS_MARK(other))
+                MAP_COUNT(ll->counters, cas_failures, 1);
+
+                // Load the link again instead of using <other>. Under RCU_IBR only rcu_load() makes sure the item
+                // is covered by the eras this thread has reserved.
+                other = rcu_load(&pred->next);
+                if (HAS_MARK(other)) {
+                    MAP_COUNT(ll->counters, restarts, 1);
                     return find_pred(pred_ptr, item_ptr, ll, key, help_remove); // retry
+                }
                 item = GET_NODE(other);
-                next = (item != NULL) ? item->next : DOES_NOT_EXIST;
+#ifdef LIST_USE_HAZARD_POINTER
+                if (item != NULL && !protect_item(hp0, pred, item)) {
+                    MAP_COUNT(ll->counters, restarts, 1);
+                    return find_pred(pred_ptr, item_ptr, ll, key, help_remove); // retry
+                }
+#endif
+                next = (item != NULL) ? rcu_load(&item->next) : DOES_NOT_EXIST;
             }
         }
 
@@ -185,7 +284,9 @@ static int find_pred (node_t **pred_ptr, node_t **item_ptr, list_t *ll, map_key_
     if (pred_ptr != NULL) {
         *pred_ptr = pred;
     }
-    *item_ptr = NULL;
+    if (item_ptr != NULL) {
+        *item_ptr = NULL;
+    }
     TRACE("l2", "find_pred: reached end of list. last item is %p", pred, 0);
     return FALSE;
 }
@@ -227,8 +328,8 @@ map_val_t ll_cas (list_t *ll, map_key_t key, map_val_t expectation, map_val_t ne
 
             // Create a new item and insert it into the list.
             TRACE("l2", "ll_cas: attempting to insert item between %p and %p", pred, pred->next);
-            map_key_t new_key = ll->key_type == NULL ? key : (map_key_t)ll->key_type->clone((void *)key);
-            node_t *new_item = node_alloc(new_key, new_val);
+            map_key_t new_key = clone_key(ll, key);
+            node_t *new_item = node_alloc(ll, new_key, new_val);
             markable_t next = new_item->next = (markable_t)old_item;
             markable_t other = SYNC_CAS(&pred->next, (markable_t)next, (markable_t)new_item);
             if (other == next) {
@@ -238,10 +339,13 @@ map_val_t ll_cas (list_t *ll, map_key_t key, map_val_t expectation, map_val_t ne
 
             // Lost a race. Failed to insert the new item into the list.
             TRACE("l1", "ll_cas: lost a race. CAS failed. expected pred's link to be %p but found %p", next, other);
-            if (ll->key_type != NULL) {
+            MAP_COUNT(ll->counters, cas_failures, 1);
+            if (ll->key_type != NULL && !ll->keys_in_arena) {
                 nbd_free((void *)new_key);
             }
-            nbd_free(new_item);
+            if (ll->arena == NULL) {
+                nbd_free(new_item);
+            }
             continue; // retry
         }
 
@@ -251,6 +355,7 @@ map_val_t ll_cas (list_t *ll, map_key_t key, map_val_t expectation, map_val_t ne
             // If the item's value is DOES_NOT_EXIST it means another thread removed the node out from under us.
             if (EXPECT_FALSE(old_item_val == DOES_NOT_EXIST)) {
                 TRACE("l2", "ll_cas: lost a race, found an item but another thread removed it. retry", 0, 0);
+                MAP_COUNT(ll->counters, restarts, 1);
                 break; // retry
             }
 
@@ -270,6 +375,7 @@ map_val_t ll_cas (list_t *ll, map_key_t key, map_val_t expectation, map_val_t ne
                 return ret_val; // success
             }
             TRACE("l2", "ll_cas: lost a race. the CAS failed. another thread changed the item's value", 0, 0);
+            MAP_COUNT(ll->counters, cas_failures, 1);
 
             old_item_val = ret_val;
         } while (1);
@@ -296,6 +402,9 @@ map_val_t ll_remove (list_t *ll, map_key_t key) {
             TRACE("l1", "ll_remove: lost a race -- %p is already marked for removal by another thread", item, 0);
             return DOES_NOT_EXIST;
         }
+        if (next != old_next) {
+            MAP_COUNT(ll->counters, cas_failures, 1);
+        }
     } while (next != old_next);
     TRACE("l2", "ll_remove: logically removed item %p", item, 0);
     ASSERT(HAS_MARK(VOLATILE_DEREF(item).next));
@@ -316,22 +425,14 @@ map_val_t ll_remove (list_t *ll, map_key_t key) {
     } 
 
     // The thread that completes the unlink should free the memory.
-#ifdef LIST_USE_HAZARD_POINTER
-    free_t free_ = (ll->key_type != NULL ? (free_t)nbd_free_node : nbd_free);
-    haz_defer_free(GET_NODE(item), free_);
-#else
-    if (ll->key_type != NULL) {
-        rcu_defer_free((void *)item->key);
-    }
-    rcu_defer_free(item);
-#endif
+    defer_free_node(ll, item);
     TRACE("l1", "ll_remove: successfully unlinked item %p from the list", item, 0);
     return val;
 }
 
 void ll_print (list_t *ll, int verbose) {
     if (verbose) {
-        markable_t next = ll->head->next;
+        markable_t next = rcu_load(&ll->head->next);
         int i = 0;
         while (next != DOES_NOT_EXIST) {
             node_t *item = STRIP_MARK(next);
@@ -343,7 +444,7 @@ void ll_print (list_t *ll, int verbose) {
                 printf("...");
                 break;
             }
-            next = item->next;
+            next = rcu_load(&item->next);
         }
         printf("\n");
     }
@@ -352,6 +453,8 @@ void ll_print (list_t *ll, int verbose) {
 
 ll_iter_t *ll_iter_begin (list_t *ll, map_key_t key) {
     ll_iter_t *iter = (ll_iter_t *)nbd_malloc(sizeof(ll_iter_t));
+    iter->ll = ll;
+    iter->paused = FALSE;
     if (key != DOES_NOT_EXIST) {
         find_pred(&iter->pred, NULL, ll, key, FALSE);
     } else {
@@ -363,8 +466,24 @@ ll_iter_t *ll_iter_begin (list_t *ll, map_key_t key) {
     return iter;
 }
 
+// Find the place the iterator left off. If the last item it returned is gone, it resumes at the first item after
+// where it was.
+static void resume_iter (ll_iter_t *iter) {
+    node_t *item;
+    if (find_pred(&iter->pred, &item, iter->ll, iter->key, FALSE)) {
+        iter->pred = item;
+    }
+    if (iter->ll->key_type != NULL) {
+        nbd_free((void *)iter->key);
+    }
+    iter->paused = FALSE;
+}
+
 map_val_t ll_iter_next (ll_iter_t *iter, map_key_t *key_ptr) {
     assert(iter);
+    if (EXPECT_FALSE(iter->paused)) {
+        resume_iter(iter);
+    }
     if (iter->pred == NULL)
         return DOES_NOT_EXIST;
 
@@ -375,7 +494,7 @@ map_val_t ll_iter_next (ll_iter_t *iter, map_key_t *key_ptr) {
 #endif
     do {
 #ifndef LIST_USE_HAZARD_POINTER 
-        item = iter->pred->next;
+        item = rcu_load(&iter->pred->next);
 #else //LIST_USE_HAZARD_POINTER 
         do {
             item = iter->pred->next;
@@ -385,17 +504,33 @@ map_val_t ll_iter_next (ll_iter_t *iter, map_key_t *key_ptr) {
         iter->pred = STRIP_MARK(item);
         if (iter->pred == NULL)
             return DOES_NOT_EXIST;
-    } while (HAS_MARK(item));
+    } while (HAS_MARK(VOLATILE_DEREF(iter->pred).next)); // the mark on <item> is for the item before it
 
     if (key_ptr != NULL) {
-        *key_ptr = GET_NODE(item)->key;
+        *key_ptr = iter->pred->key;
     }
-    return GET_NODE(item)->val;
+    return iter->pred->val;
+}
+
+// Remember the key of the last item returned, so the iterator doesn't need a reference to it. With hazard pointers
+// the iterator's reference doesn't depend on the critical section, and this does nothing.
+void ll_iter_yield (ll_iter_t *iter) {
+#ifndef LIST_USE_HAZARD_POINTER
+    if (iter->paused || iter->pred == NULL || iter->pred == iter->ll->head)
+        return;
+    const datatype_t *key_type = iter->ll->key_type;
+    iter->key = (key_type == NULL) ? iter->pred->key : (map_key_t)key_type->clone((void *)iter->pred->key);
+    iter->pred = NULL;
+    iter->paused = TRUE;
+#endif
 }
 
 void ll_iter_free (ll_iter_t *iter) {
 #ifdef LIST_USE_HAZARD_POINTER
     haz_unregister_dynamic((void **)&iter->pred);
 #endif
-    nbd_free(iter);
+    if (iter->paused && iter->ll->key_type != NULL) {
+        nbd_free((void *)iter->key);
+    }
+    nbd_free_sized(iter, sizeof(ll_iter_t));
 }
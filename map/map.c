@@ -5,18 +5,39 @@
  * generic interface for map-like data structures
  */
 
+#include <stdio.h>
 #include "common.h"
+#include "runtime.h"
 #include "map.h"
 #include "mem.h"
+#include "arena.h"
+#include "rcu.h"
+#include "latency.h"
 
 struct map {
     const map_impl_t *impl;
     void *data;
 };
 
+// Threads only get a row once they count something in the map, and the table of rows only grows as far as the
+// highest thread index that has. A slot of a table that is being replaced is frozen if it is still empty, so a
+// thread can't put its row in it after it has been copied.
+#define ROW_FROZEN ((map_stats_t *)1)
+#define MAP_COUNTERS_MIN_ROWS 8
+
+typedef struct row_table {
+    int size;
+    map_stats_t *row[0]; // indexed by thread index
+} row_table_t;
+
+struct map_counters {
+    row_table_t *table;
+};
+
 struct map_iter {
     const map_impl_t *impl;
     void *state;
+    int left; // items to return before leaving the critical section
 };
 
 map_t *map_alloc (const map_impl_t *map_impl, const datatype_t *key_type) {
@@ -26,54 +47,217 @@ map_t *map_alloc (const map_impl_t *map_impl, const datatype_t *key_type) {
     return map;
 }
 
+// The map's nodes and keys come from an arena, which makes freeing the map O(1). Memory for removed items is
+// only reclaimed when the map is freed, so this is for maps that don't live long.
+map_t *map_alloc_arena (const map_impl_t *map_impl, const datatype_t *key_type) {
+    if (map_impl->alloc_arena == NULL)
+        return map_alloc(map_impl, key_type);
+    map_t *map = nbd_malloc(sizeof(map_t));
+    map->impl  = map_impl;
+    map->data  = map->impl->alloc_arena(key_type, nbd_arena_create());
+    return map;
+}
+
 void map_free (map_t *map) {
     map->impl->free_(map->data);
 }
 
 void map_print (map_t *map, int verbose) {
+    rcu_enter();
     map->impl->print(map->data, verbose);
+    rcu_leave();
+    if (map_get_counters(map) != NULL) {
+        map_stats_t s;
+        map_stats(map, &s, -1);
+        printf("cas failures:%llu restarts:%llu copy help:%llu unlink assists:%llu\n", s.cas_failures, s.restarts,
+               s.copy_help, s.unlink_assists);
+    }
+}
+
+void map_stats (map_t *map, map_stats_t *stats, int thread_index) {
+    map_counters_t *counters = map_get_counters(map);
+    if (counters == NULL) {
+        memset(stats, 0, sizeof(map_stats_t));
+        return;
+    }
+    map_counters_sum(counters, stats, thread_index);
+}
+
+map_counters_t *map_get_counters (map_t *map) {
+    return (map->impl->counters != NULL) ? map->impl->counters(map->data) : NULL;
+}
+
+static row_table_t *row_table_alloc (int size) {
+    row_table_t *t = (row_table_t *)nbd_malloc(sizeof(row_table_t) + sizeof(map_stats_t *) * size);
+    memset(t->row, 0, sizeof(map_stats_t *) * size);
+    t->size = size;
+    return t;
+}
+
+map_counters_t *map_counters_alloc (void) {
+    map_counters_t *counters = (map_counters_t *)nbd_malloc(sizeof(map_counters_t));
+    counters->table = row_table_alloc(MAP_COUNTERS_MIN_ROWS);
+    return counters;
+}
+
+void map_counters_free (map_counters_t *counters) {
+    row_table_t *t = counters->table;
+    for (int i = 0; i < t->size; ++i) {
+        if (t->row[i] != NULL && t->row[i] != ROW_FROZEN) {
+            nbd_free(t->row[i]);
+        }
+    }
+    nbd_free(t);
+    nbd_free(counters);
+}
+
+// Replace <t> with a copy that has room for <thread_index>. If another thread replaces it first, its copy is
+// used instead. Threads that are still reading <t> are in a critical section, so it is freed with rcu_defer_free().
+static void grow_rows (map_counters_t *counters, row_table_t *t, int thread_index) {
+    int size = t->size * 2;
+    while (size <= thread_index) {
+        size *= 2;
+    }
+    row_table_t *bigger = row_table_alloc(size);
+    for (int i = 0; i < t->size; ++i) {
+        map_stats_t *row = VOLATILE_DEREF(&t->row[i]);
+        if (row == NULL) {
+            row = SYNC_CAS(&t->row[i], NULL, ROW_FROZEN);
+        }
+        bigger->row[i] = (row == ROW_FROZEN) ? NULL : row;
+    }
+    if (SYNC_CAS(&counters->table, t, bigger) == t) {
+        rcu_defer_free(t);
+    } else {
+        nbd_free(bigger);
+    }
+}
+
+static map_stats_t *add_row (map_counters_t *counters, int thread_index) {
+    map_stats_t *row = (map_stats_t *)nbd_malloc(sizeof(map_stats_t));
+    memset(row, 0, sizeof(map_stats_t));
+    do {
+        row_table_t *t = VOLATILE_DEREF(&counters->table);
+        if (thread_index < t->size) {
+            map_stats_t *old = SYNC_CAS(&t->row[thread_index], NULL, row);
+            if (old == NULL)
+                return row;
+            if (old != ROW_FROZEN) {
+                nbd_free(row); // the index already has a row, from a thread that had it before
+                return old;
+            }
+        }
+        grow_rows(counters, t, thread_index);
+    } while (1);
+}
+
+// Only the thread a row belongs to writes to it, so the counts don't need to be updated atomically. The caller is
+// in a critical section, which keeps the table it reads from being freed.
+map_stats_t *map_counters_row (map_counters_t *counters) {
+    int i = nbd_thread_index();
+    row_table_t *t = VOLATILE_DEREF(&counters->table);
+    if (EXPECT_TRUE(i < t->size)) {
+        map_stats_t *row = VOLATILE_DEREF(&t->row[i]);
+        if (EXPECT_TRUE(row != NULL && row != ROW_FROZEN))
+            return row;
+    }
+    return add_row(counters, i);
+}
+
+void map_counters_sum (map_counters_t *counters, map_stats_t *stats, int thread_index) {
+    memset(stats, 0, sizeof(map_stats_t));
+    rcu_enter();
+    row_table_t *t = VOLATILE_DEREF(&counters->table);
+    for (int i = 0; i < t->size; ++i) {
+        if (thread_index != -1 && i != thread_index)
+            continue;
+        map_stats_t *row = VOLATILE_DEREF(&t->row[i]);
+        if (row == NULL || row == ROW_FROZEN)
+            continue;
+        stats->cas_failures   += VOLATILE_DEREF(row).cas_failures;
+        stats->restarts       += VOLATILE_DEREF(row).restarts;
+        stats->copy_help      += VOLATILE_DEREF(row).copy_help;
+        stats->unlink_assists += VOLATILE_DEREF(row).unlink_assists;
+    }
+    rcu_leave();
 }
 
 map_val_t map_count (map_t *map) {
-    return map->impl->count(map->data);
+    rcu_enter();
+    map_val_t count = map->impl->count(map->data);
+    rcu_leave();
+    return count;
 }
 
 map_val_t map_get (map_t *map, map_key_t key) {
-    return map->impl->get(map->data, key);
+    uint64_t start = latency_start();
+    rcu_enter();
+    map_val_t val = map->impl->get(map->data, key);
+    rcu_leave();
+    latency_end(NBD_LATENCY_MAP_GET, start);
+    return val;
 }
 
 map_val_t map_set (map_t *map, map_key_t key, map_val_t new_val) {
-    return map->impl->cas(map->data, key, CAS_EXPECT_WHATEVER, new_val);
+    return map_cas(map, key, CAS_EXPECT_WHATEVER, new_val);
 }
 
 map_val_t map_add (map_t *map, map_key_t key, map_val_t new_val) {
-    return map->impl->cas(map->data, key, CAS_EXPECT_DOES_NOT_EXIST, new_val);
+    return map_cas(map, key, CAS_EXPECT_DOES_NOT_EXIST, new_val);
 }
 
 map_val_t map_cas (map_t *map, map_key_t key, map_val_t expected_val, map_val_t new_val) {
-    return map->impl->cas(map->data, key, expected_val, new_val);
+    uint64_t start = latency_start();
+    rcu_enter();
+    map_val_t old_val = map->impl->cas(map->data, key, expected_val, new_val);
+    rcu_leave();
+    latency_end(NBD_LATENCY_MAP_CAS, start);
+    return old_val;
 }
 
 map_val_t map_replace(map_t *map, map_key_t key, map_val_t new_val) {
-    return map->impl->cas(map->data, key, CAS_EXPECT_EXISTS, new_val);
+    return map_cas(map, key, CAS_EXPECT_EXISTS, new_val);
 }
 
 map_val_t map_remove (map_t *map, map_key_t key) {
-    return map->impl->remove(map->data, key);
+    uint64_t start = latency_start();
+    rcu_enter();
+    map_val_t val = map->impl->remove(map->data, key);
+    rcu_leave();
+    latency_end(NBD_LATENCY_MAP_REMOVE, start);
+    return val;
 }
 
+// The thread is inside a critical section until the iterator is freed, but it leaves it for a moment every
+// MAP_ITER_BATCH items. Otherwise a long scan would hold up the reclamation of memory on every thread.
 map_iter_t * map_iter_begin (map_t *map, map_key_t key) {
     map_iter_t *iter = nbd_malloc(sizeof(map_iter_t));
     iter->impl  = map->impl;
+    iter->left  = MAP_ITER_BATCH;
+    rcu_enter();
     iter->state = map->impl->iter_begin(map->data, key);
     return iter;
 }
 
 map_val_t map_iter_next (map_iter_t *iter, map_key_t *key_ptr) {
+    if (EXPECT_FALSE(iter->left == 0)) {
+        if (iter->impl->iter_yield != NULL) {
+            iter->impl->iter_yield(iter->state);
+            rcu_leave();
+            LOCALIZE_THREAD_LOCAL(RcuDepth, int);
+            if (RcuDepth == 0) {
+                rcu_quiescent();
+            }
+            rcu_enter();
+        }
+        iter->left = MAP_ITER_BATCH;
+    }
+    iter->left--;
     return iter->impl->iter_next(iter->state, key_ptr);
 }
 
 void map_iter_free (map_iter_t *iter) {
     iter->impl->iter_free(iter->state);
-    nbd_free(iter);
+    rcu_leave();
+    nbd_free_sized(iter, sizeof(map_iter_t));
 }
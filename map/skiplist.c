@@ -24,7 +24,12 @@
 #include "skiplist.h"
 #include "runtime.h"
 #include "mem.h"
+#include "pool.h"
+#include "arena.h"
 #include "rcu.h"
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+#include "hazard.h"
+#endif
 
 // Setting MAX_LEVELS to 1 essentially makes this data structure the Harris-Michael lock-free list (see list.c).
 #define MAX_LEVELS 24
@@ -39,17 +44,26 @@ typedef struct node {
     map_key_t key;
     map_val_t val;
     unsigned num_levels;
+#ifdef RCU_IBR
+    uint64_t birth; // the era the node was allocated in
+#endif
     markable_t next[1];
 } node_t;
 
 struct sl_iter {
     node_t *next;
+    skiplist_t *sl;
+    map_key_t key; // where to resume after sl_iter_yield(), if <next> is NULL
+    int paused;
 };
 
 struct sl {
     node_t *head;
     const datatype_t *key_type;
     int high_water; // max historic number of levels
+    nbd_arena_t *arena; // if not NULL, the nodes come from here and are never freed individually
+    int keys_in_arena;
+    map_counters_t *counters;
 };
 
 // Marking the <next> field of a node logically removes it from the list
@@ -79,71 +93,165 @@ static int random_levels (skiplist_t *sl) {
     return levels;
 }
 
-static node_t *node_alloc (int num_levels, map_key_t key, map_val_t val) {
+// Nodes of each height come from their own pool, shared by all skiplists.
+static nbd_pool_t *node_pool_[MAX_LEVELS + 1] = {};
+
+static node_t *node_alloc (skiplist_t *sl, int num_levels, map_key_t key, map_val_t val) {
     assert(num_levels >= 0 && num_levels <= MAX_LEVELS);
     size_t sz = sizeof(node_t) + (num_levels - 1) * sizeof(node_t *);
-    node_t *item = (node_t *)nbd_malloc(sz);
+    node_t *item;
+    if (sl->arena != NULL) {
+        item = (node_t *)arena_alloc(sl->arena, sz);
+    } else {
+        item = (node_t *)pool_alloc(nbd_pool_get(&node_pool_[num_levels], sz));
+    }
     memset(item, 0, sz);
     item->key = key;
     item->val = val;
     item->num_levels = num_levels;
+#ifdef RCU_IBR
+    item->birth = rcu_era();
+#endif
     TRACE("s2", "node_alloc: new node %p (%llu levels)", item, num_levels);
     return item;
 }
 
+static map_key_t clone_key (skiplist_t *sl, map_key_t key) {
+    if (sl->key_type == NULL)
+        return key;
+    if (sl->arena != NULL)
+        return (map_key_t)arena_clone(sl->arena, sl->key_type, (void *)key);
+    return (map_key_t)sl->key_type->clone((void *)key);
+}
+
 skiplist_t *sl_alloc (const datatype_t *key_type) {
-    skiplist_t *sl = (skiplist_t *)nbd_malloc(sizeof(skiplist_t));
+    return sl_alloc_arena(key_type, NULL);
+}
+
+skiplist_t *sl_alloc_arena (const datatype_t *key_type, nbd_arena_t *arena) {
+    skiplist_t *sl;
+    if (arena != NULL) {
+        sl = (skiplist_t *)arena_alloc(arena, sizeof(skiplist_t));
+    } else {
+        sl = (skiplist_t *)nbd_malloc(sizeof(skiplist_t));
+    }
     sl->key_type = key_type;
     sl->high_water = 1;
-    sl->head = node_alloc(MAX_LEVELS, 0, 0);
+    sl->arena = arena;
+    sl->keys_in_arena = (arena != NULL && key_type != NULL && key_type->size != NULL);
+    sl->counters = map_counters_alloc();
+    sl->head = node_alloc(sl, MAX_LEVELS, 0, 0);
     memset(sl->head->next, 0, MAX_LEVELS * sizeof(skiplist_t *));
     return sl;
 }
 
 void sl_free (skiplist_t *sl) {
+    map_counters_free(sl->counters);
+    if (sl->arena != NULL && (sl->key_type == NULL || sl->keys_in_arena)) {
+        nbd_arena_free(sl->arena);
+        return;
+    }
     node_t *item = GET_NODE(sl->head->next[0]);
     while (item) {
         node_t *next = STRIP_MARK(item->next[0]);
-        if (sl->key_type != NULL) {
+        if (sl->key_type != NULL && !sl->keys_in_arena) {
             nbd_free((void *)item->key);
         }
-        nbd_free(item);
+        if (sl->arena == NULL) {
+            nbd_free(item);
+        }
         item = next;
     }
+    if (sl->arena != NULL) {
+        nbd_arena_free(sl->arena);
+    }
+}
+
+map_counters_t *sl_counters (skiplist_t *sl) {
+    return sl->counters;
 }
 
 size_t sl_count (skiplist_t *sl) {
     size_t count = 0;
-    node_t *item = GET_NODE(sl->head->next[0]);
+    node_t *item = GET_NODE(rcu_load(&sl->head->next[0]));
     while (item) {
         if (!HAS_MARK(item->next[0])) {
             count++;
         }
-        item = STRIP_MARK(item->next[0]);
+        item = STRIP_MARK(rcu_load(&item->next[0]));
     }
     return count;
 }
 
+static void nbd_free_node (node_t *x) {
+    nbd_free((void *)x->key);
+    nbd_free(x);
+}
+
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+// Static hazard pointers used by the skiplist. find_preds() walks with two of them, and copies the predecessor
+// and successor it finds at each level into that level's pair, so they stay protected until the caller is done.
+#define HAZ_ITEM      0
+#define HAZ_PRED      1
+#define HAZ_NEW_ITEM  2
+#define HAZ_PREDS     3
+#define HAZ_SUCCS     (HAZ_PREDS + MAX_LEVELS)
+#if HAZ_SUCCS + MAX_LEVELS > STATIC_HAZ_PER_THREAD
+#error not enough static hazard pointers for the skiplist
+#endif
+
+// Publish a hazard pointer to the successor of <pred> at <level> and return it in <*item_ptr>. Fails if <pred> is
+// marked at <level>, because then it could already be unlinked, and its successor freed.
+static inline int protect_next (haz_t *hp, node_t *pred, int level, node_t **item_ptr) {
+    markable_t next = VOLATILE_DEREF(pred).next[level];
+    do {
+        if (HAS_MARK(next))
+            return FALSE;
+        haz_set(hp, GET_NODE(next));
+        markable_t again = VOLATILE_DEREF(pred).next[level];
+        if (again == next) {
+            *item_ptr = GET_NODE(next);
+            return TRUE;
+        }
+        next = again;
+    } while (1);
+}
+#endif
+
 static node_t *find_preds (node_t **preds, node_t **succs, int n, skiplist_t *sl, map_key_t key, enum unlink unlink) {
     node_t *pred = sl->head;
     node_t *item = NULL;
     TRACE("s2", "find_preds: searching for key %p in skiplist (head is %p)", key, pred);
     int d = 0;
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+    // Skipping over a removed item means following its link, which isn't safe once it could be unlinked.
+    if (unlink == DONT_UNLINK) {
+        unlink = ASSIST_UNLINK;
+    }
+    haz_t *temp, *hp0 = haz_get_static(HAZ_ITEM), *hp1 = haz_get_static(HAZ_PRED);
+#endif
 
     // Traverse the levels of <sl> from the top level to the bottom
     for (int level = sl->high_water - 1; level >= 0; --level) {
-        markable_t next = pred->next[level];
+        markable_t next = rcu_load(&pred->next[level]);
         if (next == DOES_NOT_EXIST && level >= n)
             continue;
         TRACE("s3", "find_preds: traversing level %p starting at %p", level, pred);
         if (EXPECT_FALSE(HAS_MARK(next))) {
             TRACE("s2", "find_preds: pred %p is marked for removal (next %p); retry", pred, next);
             ASSERT(level == pred->num_levels - 1 || HAS_MARK(pred->next[level+1]));
+            MAP_COUNT(sl->counters, restarts, 1);
             return find_preds(preds, succs, n, sl, key, unlink); // retry
         }
         item = GET_NODE(next);
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+        if (!protect_next(hp0, pred, level, &item)) {
+            MAP_COUNT(sl->counters, restarts, 1);
+            return find_preds(preds, succs, n, sl, key, unlink); // retry
+        }
+#endif
         while (item != NULL) {
-            next = item->next[level];
+            next = rcu_load(&item->next[level]);
 
             // A tag means an item is logically removed but not physically unlinked yet.
             while (EXPECT_FALSE(HAS_MARK(next))) {
@@ -154,21 +262,37 @@ static node_t *find_preds (node_t **preds, node_t **succs, int n, skiplist_t *sl
                     item = STRIP_MARK(next);
                     if (EXPECT_FALSE(item == NULL))
                         break;
-                    next = item->next[level];
+                    next = rcu_load(&item->next[level]);
                 } else {
 
                     // Unlink logically removed items.
                     markable_t other = SYNC_CAS(&pred->next[level], (markable_t)item, (markable_t)STRIP_MARK(next));
                     if (other == (markable_t)item) {
                         TRACE("s3", "find_preds: unlinked item from pred %p", pred, 0);
+                        if (unlink == ASSIST_UNLINK) {
+                            MAP_COUNT(sl->counters, unlink_assists, 1);
+                        }
                         item = STRIP_MARK(next);
                     } else {
                         TRACE("s3", "find_preds: lost race to unlink item pred %p's link changed to %p", pred, other);
-                        if (HAS_MARK(other))
+                        MAP_COUNT(sl->counters, cas_failures, 1);
+
+                        // Load the link again instead of using <other>. Under RCU_IBR only rcu_load() makes sure
+                        // the item is covered by the eras this thread has reserved.
+                        other = rcu_load(&pred->next[level]);
+                        if (HAS_MARK(other)) {
+                            MAP_COUNT(sl->counters, restarts, 1);
                             return find_preds(preds, succs, n, sl, key, unlink); // retry
+                        }
                         item = GET_NODE(other);
                     }
-                    next = (item != NULL) ? item->next[level] : DOES_NOT_EXIST;
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+                    if (!protect_next(hp0, pred, level, &item)) {
+                        MAP_COUNT(sl->counters, restarts, 1);
+                        return find_preds(preds, succs, n, sl, key, unlink); // retry
+                    }
+#endif
+                    next = (item != NULL) ? rcu_load(&item->next[level]) : DOES_NOT_EXIST;
                 }
             }
 
@@ -193,6 +317,13 @@ static node_t *find_preds (node_t **preds, node_t **succs, int n, skiplist_t *sl
 
             pred = item;
             item = GET_NODE(next);
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+            temp = hp0; hp0 = hp1; hp1 = temp;
+            if (!protect_next(hp0, pred, level, &item)) {
+                MAP_COUNT(sl->counters, restarts, 1);
+                return find_preds(preds, succs, n, sl, key, unlink); // retry
+            }
+#endif
         }
 
         TRACE("s3", "find_preds: found pred %p next %p", pred, item);
@@ -204,6 +335,10 @@ static node_t *find_preds (node_t **preds, node_t **succs, int n, skiplist_t *sl
             if (succs != NULL) {
                 succs[level] = item;
             }
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+            haz_set(haz_get_static(HAZ_PREDS + level), pred);
+            haz_set(haz_get_static(HAZ_SUCCS + level), item);
+#endif
         }
     }
 
@@ -234,9 +369,9 @@ map_val_t sl_lookup (skiplist_t *sl, map_key_t key) {
 }
 
 map_key_t sl_min_key (skiplist_t *sl) {
-    node_t *item = GET_NODE(sl->head->next[0]);
+    node_t *item = GET_NODE(rcu_load(&sl->head->next[0]));
     while (item != NULL) {
-        markable_t next = item->next[0];
+        markable_t next = rcu_load(&item->next[0]);
         if (!HAS_MARK(next))
             return item->key;
         item = STRIP_MARK(next);
@@ -244,7 +379,7 @@ map_key_t sl_min_key (skiplist_t *sl) {
     return DOES_NOT_EXIST;
 }
 
-static map_val_t update_item (node_t *item, map_val_t expectation, map_val_t new_val) {
+static map_val_t update_item (skiplist_t *sl, node_t *item, map_val_t expectation, map_val_t new_val) {
     map_val_t old_val = item->val;
 
     // If the item's value is DOES_NOT_EXIST it means another thread removed the node out from under us.
@@ -267,9 +402,10 @@ static map_val_t update_item (node_t *item, map_val_t expectation, map_val_t new
         return old_val; // success
     }
     TRACE("s2", "update_item: lost a race. the CAS failed. another thread changed the item's value", 0, 0);
+    MAP_COUNT(sl->counters, cas_failures, 1);
 
     // retry
-    return update_item(item, expectation, new_val); // tail call
+    return update_item(sl, item, expectation, new_val); // tail call
 }
 
 map_val_t sl_cas (skiplist_t *sl, map_key_t key, map_val_t expectation, map_val_t new_val) {
@@ -285,11 +421,12 @@ map_val_t sl_cas (skiplist_t *sl, map_key_t key, map_val_t expectation, map_val_
 
     // If there is already an item in the skiplist that matches the key just update its value.
     if (old_item != NULL) {
-        map_val_t ret_val = update_item(old_item, expectation, new_val);
+        map_val_t ret_val = update_item(sl, old_item, expectation, new_val);
         if (ret_val != DOES_NOT_EXIST)
             return ret_val;
 
         // If we lose a race with a thread removing the item we tried to update then we have to retry.
+        MAP_COUNT(sl->counters, restarts, 1);
         return sl_cas(sl, key, expectation, new_val); // tail call
     }
 
@@ -300,8 +437,8 @@ map_val_t sl_cas (skiplist_t *sl, map_key_t key, map_val_t expectation, map_val_
 
     // Create a new node and insert it into the skiplist.
     TRACE("s3", "sl_cas: attempting to insert a new item between %p and %p", preds[0], nexts[0]);
-    map_key_t new_key = sl->key_type == NULL ? key : (map_key_t)sl->key_type->clone((void *)key);
-    new_item = node_alloc(n, new_key, new_val);
+    map_key_t new_key = clone_key(sl, key);
+    new_item = node_alloc(sl, n, new_key, new_val);
 
     // Set <new_item>'s next pointers to their proper values
     markable_t next = new_item->next[0] = (markable_t)nexts[0];
@@ -309,6 +446,13 @@ map_val_t sl_cas (skiplist_t *sl, map_key_t key, map_val_t expectation, map_val_
         new_item->next[level] = (markable_t)nexts[level];
     }
 
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+    // Another thread can remove <new_item> as soon as it is in the bottom level, while it is still being linked
+    // into the levels above. Keep it from being freed until it is unlinked from all of them (see below).
+    haz_t *hp_new = haz_get_static(HAZ_NEW_ITEM);
+    haz_set(hp_new, new_item);
+#endif
+
     // Link <new_item> into <sl> from the bottom level up. After <new_item> is inserted into the bottom level
     // it is officially part of the skiplist.
     node_t *pred = preds[0];
@@ -317,10 +461,13 @@ map_val_t sl_cas (skiplist_t *sl, map_key_t key, map_val_t expectation, map_val_
         TRACE("s3", "sl_cas: failed to change pred's link: expected %p found %p", next, other);
 
         // Lost a race to another thread modifying the skiplist. Free the new item we allocated and retry.
-        if (sl->key_type != NULL) {
+        MAP_COUNT(sl->counters, cas_failures, 1);
+        if (sl->key_type != NULL && !sl->keys_in_arena) {
             nbd_free((void *)new_key);
         }
-        nbd_free(new_item);
+        if (sl->arena == NULL) {
+            nbd_free(new_item);
+        }
         return sl_cas(sl, key, expectation, new_val); // tail call
     }
 
@@ -338,6 +485,7 @@ map_val_t sl_cas (skiplist_t *sl, map_key_t key, map_val_t expectation, map_val_
             if (other == (markable_t)nexts[level])
                 break; // successfully linked <new_item> into the skiplist at the current <level>
             TRACE("s3", "sl_cas: lost a race. failed to change pred's link. expected %p found %p", nexts[level], other);
+            MAP_COUNT(sl->counters, cas_failures, 1);
 
             // Find <new_item>'s new preds and nexts.
             find_preds(preds, nexts, new_item->num_levels, sl, key, ASSIST_UNLINK);
@@ -356,6 +504,9 @@ map_val_t sl_cas (skiplist_t *sl, map_key_t key, map_val_t expectation, map_val_
                 // If another thread is removing this item we can stop linking it into to skiplist
                 if (HAS_MARK(other)) {
                     find_preds(NULL, NULL, 0, sl, key, FORCE_UNLINK); // see comment below
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+                    haz_set(hp_new, NULL);
+#endif
                     return DOES_NOT_EXIST;
                 }
             }
@@ -369,6 +520,9 @@ map_val_t sl_cas (skiplist_t *sl, map_key_t key, map_val_t expectation, map_val_
     if (HAS_MARK(new_item->next[new_item->num_levels - 1])) {
         find_preds(NULL, NULL, 0, sl, key, FORCE_UNLINK);
     }
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+    haz_set(hp_new, NULL);
+#endif
 
     return DOES_NOT_EXIST; // success, inserted a new item
 }
@@ -398,6 +552,9 @@ map_val_t sl_remove (skiplist_t *sl, map_key_t key) {
                     return DOES_NOT_EXIST;
                 break;
             }
+            if (next != old_next) {
+                MAP_COUNT(sl->counters, cas_failures, 1);
+            }
         } while (next != old_next);
     }
 
@@ -409,11 +566,25 @@ map_val_t sl_remove (skiplist_t *sl, map_key_t key) {
     // unlink the item
     find_preds(NULL, NULL, 0, sl, key, FORCE_UNLINK);
 
-    // free the node
-    if (sl->key_type != NULL) {
-        rcu_defer_free((void *)item->key);
+    // free the node, and its key in the same deferred record
+    int free_key = (sl->key_type != NULL && !sl->keys_in_arena);
+    if (sl->arena == NULL) {
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+        haz_defer_free(item, free_key ? (free_t)nbd_free_node : nbd_free);
+#else
+        if (free_key) {
+            rcu_defer_call_born(item, (free_t)nbd_free_node, item->birth);
+        } else {
+            rcu_defer_free_born(item, item->birth);
+        }
+#endif
+    } else if (free_key) {
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+        haz_defer_free((void *)item->key, nbd_free);
+#else
+        rcu_defer_free_born((void *)item->key, item->birth);
+#endif
     }
-    rcu_defer_free(item);
 
     return val;
 }
@@ -428,7 +599,7 @@ void sl_print (skiplist_t *sl, int verbose) {
             printf("(%d) ", level);
             int i = 0;
             while (item) {
-                markable_t next = item->next[level];
+                markable_t next = rcu_load(&item->next[level]);
                 printf("%s%p ", HAS_MARK(next) ? "*" : "", item);
                 item = STRIP_MARK(next);
                 if (i++ > 30) {
@@ -458,7 +629,7 @@ void sl_print (skiplist_t *sl, int verbose) {
             }
             printf("\n");
             fflush(stdout);
-            item = STRIP_MARK(item->next[0]);
+            item = STRIP_MARK(rcu_load(&item->next[0]));
             if (i++ > 30) {
                 printf("...\n");
                 break;
@@ -470,31 +641,92 @@ void sl_print (skiplist_t *sl, int verbose) {
 
 sl_iter_t *sl_iter_begin (skiplist_t *sl, map_key_t key) {
     sl_iter_t *iter = (sl_iter_t *)nbd_malloc(sizeof(sl_iter_t));
+    iter->sl = sl;
+    iter->paused = FALSE;
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+    // <iter->next> is protected by a hazard pointer for as long as the iterator is around.
+    iter->next = NULL;
+    haz_register_dynamic((void **)&iter->next);
+    if (key != DOES_NOT_EXIST) {
+        find_preds(NULL, &iter->next, 1, sl, key, ASSIST_UNLINK);
+    } else {
+        protect_next(haz_get_static(HAZ_ITEM), sl->head, 0, &iter->next); // the head is never marked
+    }
+#else
     if (key != DOES_NOT_EXIST) {
         find_preds(NULL, &iter->next, 1, sl, key, DONT_UNLINK);
     } else {
-        iter->next = GET_NODE(sl->head->next[0]);
+        iter->next = GET_NODE(rcu_load(&sl->head->next[0]));
     }
+#endif
     return iter;
 }
 
 map_val_t sl_iter_next (sl_iter_t *iter, map_key_t *key_ptr) {
     assert(iter);
+    if (EXPECT_FALSE(iter->paused)) {
+        // Find the place the iterator left off.
+        find_preds(NULL, &iter->next, 1, iter->sl, iter->key, DONT_UNLINK);
+        if (iter->sl->key_type != NULL) {
+            nbd_free((void *)iter->key);
+        }
+        iter->paused = FALSE;
+    }
     node_t *item = iter->next;
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+    // A removed item's link can't be followed, because the item after it could already be unlinked and freed. So
+    // the iterator finds its way back into the skiplist with the removed item's key instead.
+    while (item != NULL && HAS_MARK(VOLATILE_DEREF(item).next[0])) {
+        find_preds(NULL, &iter->next, 1, iter->sl, item->key, ASSIST_UNLINK);
+        item = iter->next;
+    }
+    if (item == NULL)
+        return DOES_NOT_EXIST;
+    if (key_ptr != NULL) {
+        *key_ptr = item->key;
+    }
+    map_val_t val = item->val;
+    node_t *next;
+    if (!protect_next(haz_get_static(HAZ_ITEM), item, 0, &next)) {
+        find_preds(NULL, &next, 1, iter->sl, item->key, ASSIST_UNLINK); // <item> is unlinked, so it isn't found
+    }
+    iter->next = next;
+    return val;
+#else
     while (item != NULL && HAS_MARK(item->next[0])) {
-        item = STRIP_MARK(item->next[0]);
+        item = STRIP_MARK(rcu_load(&item->next[0]));
     }
     if (item == NULL) {
         iter->next = NULL;
         return DOES_NOT_EXIST;
     }
-    iter->next = STRIP_MARK(item->next[0]);
+    iter->next = STRIP_MARK(rcu_load(&item->next[0]));
     if (key_ptr != NULL) {
         *key_ptr = item->key;
     }
     return item->val;
+#endif
+}
+
+// Remember the key of the next item, so the iterator doesn't need a reference to it. With hazard pointers the
+// iterator's reference doesn't depend on the critical section, and this does nothing.
+void sl_iter_yield (sl_iter_t *iter) {
+#ifndef SKIPLIST_USE_HAZARD_POINTER
+    if (iter->paused || iter->next == NULL)
+        return;
+    const datatype_t *key_type = iter->sl->key_type;
+    iter->key = (key_type == NULL) ? iter->next->key : (map_key_t)key_type->clone((void *)iter->next->key);
+    iter->next = NULL;
+    iter->paused = TRUE;
+#endif
 }
 
 void sl_iter_free (sl_iter_t *iter) {
-    nbd_free(iter);
+#ifdef SKIPLIST_USE_HAZARD_POINTER
+    haz_unregister_dynamic((void **)&iter->next);
+#endif
+    if (iter->paused && iter->sl->key_type != NULL) {
+        nbd_free((void *)iter->key);
+    }
+    nbd_free_sized(iter, sizeof(sl_iter_t));
 }